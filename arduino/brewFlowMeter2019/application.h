@@ -27,6 +27,29 @@
 #define APP_OPTIONS 4
 // Reseting app, erasing all stored values
 #define APP_RESET 5
+// Dispense is over, valve is closed
+// displaying flow statistics of the dispense, turning the rotary encoder
+// shows next page, push button returns to APP_WAITING mode
+#define APP_SUMMARY 6
+// App is in configuration mode, valve is closed
+// displaying a runtime setting name on first line and its value on second line
+// turning the rotary encoder adjusts the value, push button goes to next setting,
+// after the last one settings are saved and app returns to APP_WAITING mode
+#define APP_CONFIG 7
+// App is asking to resume a run interrupted by a power loss, valve is closed
+// displaying remaining volume on first line and  [No] Yes choice on second line.
+// push button goes to APP_RUNNING on yes, APP_WAITING on no
+#define APP_RESUME 8
+// App is in recipe selection mode, valve is closed
+// displaying recipe number and steps on first line, total volume on second line
+// turning the rotary encoder selects a recipe, push button starts it
+// (APP_RUNNING or APP_PAUSE) or returns to APP_WAITING mode on cancel
+#define APP_RECIPE 9
+// App is pausing between two recipe steps, valve is closed
+// displaying next step on first line, remaining pause and [Go] Stop choice on second line
+// push button (or end of timed pause on go) goes to APP_RUNNING for next step,
+// push button on stop ends the recipe and returns to APP_WAITING mode
+#define APP_PAUSE 10
 
 // Choices on Options screen
 //#define CHOICE_UNDEFINED -100
@@ -34,13 +57,21 @@
 #define CHOICE_RUNNING  1
 #define CHOICE_SETTING  2
 #define CHOICE_RESET    3
+#define CHOICE_CONFIG   4
+#define CHOICE_RECIPE   5
 
 #define CHOICE_NO       0
 #define CHOICE_YES      1
 
+#define CHOICE_GO       0
+#define CHOICE_STOP     1
+
 // Application variables
 int app_status;
 int app_previous_status;
+uint8_t app_config_entry; // settings entry edited in APP_CONFIG mode
+unsigned long app_valve_action_us; // micros() of the last valve action
+unsigned long app_choice_turned_at; // millis() of the last options screen turn, for debounce
 String app_error = "";
 
 /*************************************************
@@ -57,12 +88,30 @@ void application_setup() {
   Application Reset Erasing all stored values
 **************************************************/
 void application_reset() {
+  // No comparator interrupt while eeprom is erased
+  powerfail_disarm();
+  powerfail_running = false;
+  // Target is erased too, nothing to restore
+  recipe_abort();
   encoder_setup();
   flowmeter_reset();
   flowmeter_setup();
   application_setup();
 }
 
+/*************************************************
+   Forcing a new state from outside the encoder
+   (same path as a choice on the options screen) :
+   APP_OPTIONS keeps app_status untouched, so the
+   next handle_application_screens() call applies
+   the requested state and its valve action.
+ **************************************************/
+void application_goto_state(int state) {
+  app_previous_status = APP_OPTIONS;
+  app_status = state;
+  button_was_pushed = true;
+}
+
 /*************************************************
    Set current application state, taking the
    previous step in account
@@ -75,43 +124,85 @@ void application_set_current_state() {
     // no break here, to go to case APP_START
 
     case APP_START:
-      Serial.print("APP_START -> ");
       app_status = APP_SPLASH;
       break;
 
     case APP_SPLASH:
-      Serial.print("APP_SPLASH -> ");
       app_status = APP_WAITING;
+      if (powerfail_resume_offered) {
+        // An interrupted recipe goes on at the step it was in
+        if (settings.recipe_running > 0 && settings.recipe_running <= RECIPE_NB) {
+          recipe_resume();
+        }
+        // Nothing left to deliver : waiting mode ends the run
+        if (app_target_liters > flowmeter_liters) {
+          screen_choice = CHOICE_NO;
+          app_status = APP_RESUME;
+        }
+      }
+      break;
+
+    case APP_RESUME:
+      if (screen_choice == CHOICE_YES) {
+        app_status = APP_RUNNING;
+      } else {
+        powerfail_run_ended();
+        app_status = APP_WAITING;
+      }
       break;
 
     case APP_WAITING:
-      Serial.print("APP_WAITING -> ");
       app_status = APP_OPTIONS;
       break;
 
     case APP_RUNNING:
-      Serial.print("APP_RUNNING -> ");
+      app_status = APP_SUMMARY;
+      break;
+
+    case APP_RECIPE:
+      app_status = APP_WAITING;
+      if (screen_choice < RECIPE_NB && recipe_start(screen_choice)) {
+        app_status = recipe_pause_s ? APP_PAUSE : APP_RUNNING;
+      }
+      break;
+
+    case APP_PAUSE:
+      // Operator does not wait for end of pause, or stops the recipe
+      app_status = (screen_choice == CHOICE_STOP) ? APP_WAITING : APP_RUNNING;
+      break;
+
+    case APP_SUMMARY:
       app_status = APP_WAITING;
       break;
 
     case APP_SETTING:
-      Serial.print("APP_SETTING -> ");
       // Save set value
-      eeprom_write(EEPROM_TARGET_LITERS_ADDR, app_target_liters);
+      flowmeter_save();
       app_status = APP_WAITING;
       break;
 
+    case APP_CONFIG:
+      // Next setting, or save them all after the last one
+      app_config_entry++;
+      if (app_config_entry >= SETTINGS_NB_ENTRIES) {
+        settings_save();
+        app_status = APP_WAITING;
+      }
+      break;
+
     case APP_OPTIONS:
-      Serial.print("APP_OPTIONS -> ");
+      // app_status was set by a choice, keep it
       break;
 
     default:
-      Serial.print("APP_ERROR -> ");
+      LOG_ERROR(LOG_UNKNOWN_STATE, app_previous_status);
       // see if we need to reset something ?
       app_error = "No known state for LCD ?";
       app_status = APP_ERROR;
       break;
   }
+  // After APP_RESET, previous status is the APP_START it restarted from
+  LOG_INFO(LOG_STATE, app_previous_status, app_status);
   app_previous_status = app_status;
 }
 
@@ -130,12 +221,22 @@ void application_set_current_state() {
    /!\ /!\ /!\ /!\ /!\ /!\ /!\ /!\ /!\ /!\ /!\
  **************************************************/
 void application_display() {
+  // Valve first : screen and eeprom writes take milliseconds
+  if ( app_status == APP_RUNNING ) {
+    valve.open();
+  } else {
+    valve.close();
+  }
+  app_valve_action_us = micros();
+  if ( app_status != APP_RUNNING ) {
+    // No run to protect, eeprom saves below are safe from the comparator interrupt
+    powerfail_disarm();
+  }
+
   lcd.clear();
 
   // App is waiting for sensors or buttons changes : Valve is closed
   if ( app_status == APP_SPLASH ) {
-    Serial.println(" APP_SPLASH");
-    valve.close();
     // displaying splash screen
     lcd_setbacklight(30, 144, 255);
     lcd_splash_screen();
@@ -143,8 +244,11 @@ void application_display() {
 
   // Waiting for a button push to start running water
   if ( app_status == APP_WAITING ) {
-    Serial.println(" APP_WAITING");
-    valve.close();
+    recipe_stop();
+    // However we got here (serial STOP on resume screen...), no run is left
+    if (settings.dispensing) {
+      powerfail_run_ended();
+    }
     flowmeter_calculate_pct_of_target_liters();
     // Background color is blue, dodgerBlue.
     lcd_setbacklight(30, 144, 255);
@@ -153,25 +257,60 @@ void application_display() {
 
   // Displays configuration menu
   if ( app_status == APP_OPTIONS ) {
-    Serial.println(" APP_OPTIONS");
-    valve.close();
     lcd_options_mode();
   }
 
   // Displays screen to se target liters
   if ( app_status == APP_SETTING ) {
-    Serial.println(" APP_SETTING");
-    valve.close();
     lcd_setting_mode(String(app_target_liters));
   }
 
+  // Displays screen to edit runtime settings
+  if ( app_status == APP_CONFIG ) {
+    lcd_config_mode(settings_entries[app_config_entry].label, *settings_entries[app_config_entry].value);
+  }
+
+  // Asking to resume an interrupted run
+  if ( app_status == APP_RESUME ) {
+    lcd_resume_mode(app_target_liters - flowmeter_liters);
+  }
+
   // Running water thru valve and counting via flowmeter
   if ( app_status == APP_RUNNING ) {
-    Serial.println(" APP_RUNNING");
-    valve.open();
+    // A recipe reset statistics when it started, steps add to them
+    if (recipe_active) {
+      flowstats_resume();
+    } else {
+      flowstats_reset();
+    }
+    powerfail_run_started();
     lcd_running_mode(0.0, flowmeter_total_liters, app_pct_target_liters, flowmeter_liters);
   }
 
+  // Displays recipes to choose from
+  if ( app_status == APP_RECIPE ) {
+    screen_choice = 0;
+    lcd_recipe_mode();
+  }
+
+  // Pausing before next recipe step
+  if ( app_status == APP_PAUSE ) {
+    powerfail_run_ended();
+    recipe_pause_start = millis();
+    screen_choice = CHOICE_GO;
+    lcd_pause_mode();
+  }
+
+  // Displays statistics of the dispense that just closed
+  if ( app_status == APP_SUMMARY ) {
+    flowstats_close();
+    recipe_stop();
+    powerfail_run_ended();
+    screen_choice = 0;
+    lcd_setbacklight(30, 144, 255);
+    lcd_summary_mode();
+  }
+
   lcd_print();
 }
 
@@ -195,26 +334,36 @@ void handle_application_choices() {
   if ( button_was_turned ) {
     // Applicative choice
     if (app_previous_status == APP_OPTIONS) {
+      // Debounce without blocking the main loop
+      if (millis() - app_choice_turned_at < 300) {
+        button_was_turned = false;
+        return;
+      }
+      app_choice_turned_at = millis();
 
-      set_screen_choice(encoderPosCount, 4);
+      set_screen_choice(encoderPosCount, 6);
+      LOG_DEBUG(LOG_CHOICE, screen_choice);
       // We were in options mode, so see which option was choosen.
       switch (screen_choice) {
         case CHOICE_CANCEL:
-          Serial.println("CHOICE_CANCEL");
           app_status = APP_WAITING; // Canceling any action, go to waiting state
           break;
         case CHOICE_RUNNING:
-          Serial.println("CHOICE_RUNNING");
           app_status = APP_RUNNING; // Go to running mode, valve opened
           break;
         case CHOICE_SETTING:
-          Serial.println("CHOICE_SETTING");
           app_status = APP_SETTING;
           break;
         case CHOICE_RESET:
-          Serial.println("CHOICE_RESET");
           app_status = APP_RESET;
           break;
+        case CHOICE_CONFIG:
+          app_config_entry = 0;
+          app_status = APP_CONFIG;
+          break;
+        case CHOICE_RECIPE:
+          app_status = APP_RECIPE;
+          break;
         default:
           break;
       }
@@ -222,7 +371,6 @@ void handle_application_choices() {
       lcd.clear();
       lcd_options_mode();
       lcd_print();
-      delay(300); // debounce
     } else {
 
       // Setting mode 
@@ -232,6 +380,47 @@ void handle_application_choices() {
         lcd_setting_mode(String(app_target_liters));
         lcd_print();
       } 
+
+      // Config mode : adjusting current setting
+      if (app_status == APP_CONFIG) {
+        const settings_entry_t *e = &settings_entries[app_config_entry];
+        settings_set_entry(app_config_entry, *e->value + encoderPosCount * e->step);
+        lcd.clear();
+        lcd_config_mode(e->label, *e->value);
+        lcd_print();
+      }
+
+      // Resume mode : yes or no
+      if (app_status == APP_RESUME) {
+        set_screen_choice(encoderPosCount, 2);
+        lcd.clear();
+        lcd_resume_mode(app_target_liters - flowmeter_liters);
+        lcd_print();
+      }
+
+      // Recipe mode : choosing a recipe or cancel
+      if (app_status == APP_RECIPE) {
+        set_screen_choice(encoderPosCount, RECIPE_NB + 1);
+        lcd.clear();
+        lcd_recipe_mode();
+        lcd_print();
+      }
+
+      // Pause mode : go or stop
+      if (app_status == APP_PAUSE) {
+        set_screen_choice(encoderPosCount, 2);
+        lcd.clear();
+        lcd_pause_mode();
+        lcd_print();
+      }
+
+      // Summary mode : browsing statistics pages
+      if (app_status == APP_SUMMARY) {
+        set_screen_choice(encoderPosCount, SUMMARY_NB_PAGES);
+        lcd.clear();
+        lcd_summary_mode();
+        lcd_print();
+      }
     }
     button_was_turned = false;
   }
@@ -260,6 +449,8 @@ void handle_application_set_target_liters() {
 void handle_application_flometer() {
   if (app_status == APP_RUNNING) {
     if (flowmeter_was_turning) {
+      flowstats_sample();
+
       // displaying current passing volume, desired volume, total volume, flowrate
       float frac = (flw_rate - int(flw_rate)) * 10;
 
@@ -271,11 +462,25 @@ void handle_application_flometer() {
         lcd_adjust_backlight(app_pct_target_liters);
       }
 
-      // see if we got 100% of target?
-      if (app_pct_target_liters >= 100) {
+      if (recipe_active) {
+        // Recipe step delivered : next one is already prepared
+        if (recipe_step_done()) {
+          if (recipe_last_step()) {
+            app_status = APP_SUMMARY;
+            button_was_pushed = true;
+          } else {
+            recipe_advance();
+            if (recipe_pause_s) {
+              application_goto_state(APP_PAUSE);
+            }
+          }
+          flowmeter_calculate_pct_of_target_liters();
+        }
+      } else if (app_pct_target_liters >= 100) {
+        // see if we got 100% of target?
         app_pct_target_liters = 100;
-        // Forcing waiting State, this stat closes valve
-        app_status = APP_WAITING;
+        // Forcing end of run, this state closes valve
+        app_status = APP_SUMMARY;
         // Simulate a state change
         button_was_pushed = true;
       }
@@ -284,11 +489,48 @@ void handle_application_flometer() {
       lcd_running_mode(frac, flowmeter_total_liters, app_pct_target_liters, flowmeter_liters);
       lcd_print();
 
-      // Saving current flow values in EEPROM
-      eeprom_write(EEPROM_CURRENT_PULSES_ADDR, flw_pulses);
-      eeprom_write(EEPROM_TOTAL_PULSES_ADDR, flw_total_pulses);
-
       flowmeter_was_turning = false;
     }
   }
 }
+
+/*************************************************
+   applications power fail handling
+   Closes the valve as soon as supply drops, ends
+   the run once it is back, detection is re-armed
+   by the next run.
+ **************************************************/
+void handle_application_powerfail() {
+  if (powerfail_tripped && valve.status() == HIGH) {
+    valve.close();
+  }
+  if (powerfail_update() && app_status == APP_RUNNING) {
+    application_goto_state(APP_SUMMARY);
+  }
+}
+
+/*************************************************
+   applications recipe sequencer
+   Prepares next step while current one runs,
+   ends timed pauses.
+ **************************************************/
+void handle_application_recipe() {
+  if (!recipe_active) {
+    return;
+  }
+  if (!recipe_next_ready && !recipe_last_step()) {
+    recipe_prepare(recipe_step + 1);
+  }
+  if (app_status == APP_PAUSE && !button_was_pushed) {
+    if (!recipe_pausing() && screen_choice == CHOICE_GO) {
+      application_goto_state(APP_RUNNING);
+    } else if (recipe_pause_s != RECIPE_PAUSE_WAIT) {
+      // Refreshing countdown once per second
+      if (millis() - recipe_pause_refresh >= 1000) {
+        recipe_pause_refresh = millis();
+        lcd_pause_mode();
+        lcd_print();
+      }
+    }
+  }
+}
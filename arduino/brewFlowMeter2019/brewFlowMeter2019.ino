@@ -3,13 +3,19 @@
  **********************************************************************************/
 #include <Wire.h>
 #include "config.h"
+#include "log.h"
 #include "rgb_lcd.h"
 #include "valve.h"
 #include "encoder.h"
+#include "settings.h"
 #include "flowmeter.h"
+#include "flowstats.h"
+#include "powerfail.h"
+#include "recipes.h"
 Valve valve(VLV);
 #include "screens.h"
 #include "application.h"
+#include "serial_commands.h"
 
 /*************************************************
    Setup
@@ -24,18 +30,33 @@ void setup()
   // Setup encoder
   encoder_setup();
 
+  // Load settings from eeprom
+  settings_load();
+
   // setup flowmeter
   flowmeter_setup();
 
+  // Setup power fail detection, restoring an interrupted run
+  powerfail_setup();
+
   // Setup applcation
   application_setup();
 
 }
 
 void loop() {
+  // Serial port is polled between screen updates, bounding command latency
+  handle_serial_commands();
+  flowmeter_update();
   handle_application_screens();
+  handle_serial_commands();
   handle_application_choices();
+  handle_serial_commands();
   handle_application_flometer();
+  handle_serial_commands();
+  handle_application_recipe();
+  handle_application_powerfail();
+  log_flush();
 }
 
 /*********************************************************************************************************
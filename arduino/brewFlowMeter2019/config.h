@@ -1,14 +1,55 @@
 // Application Version
 #define APP_VERSION "2.0"
 
+// Flow pulses acquisition mode (see README)
+#define FLW_MODE_ISR     0  // One pin change interrupt per edge on FLW, glitch filtered
+#define FLW_MODE_COUNTER 1  // Sensor clocks Timer1 on its T1 input, read on every loop pass
+#define FLW_MODE FLW_MODE_ISR
+
 // Encoder config
 #define ENC_CLK  4     // Connected to CLK on KY-040
+#if FLW_MODE == FLW_MODE_COUNTER
+#define ENC_DT   6     // Connected to DT on KY-040, D5 is taken by flow sensor
+#else
 #define ENC_DT   5     // Connected to DT on KY-040
+#endif
 #define ENC_SW   3     // Connected to SW on KY-040
-#define ENC_STEP  0.05
+#define ENC_STEP  0.05  // Default, runtime value in settings
 
 //Valve config
 #define VLV 8
 
 // Liquid Flow sensor
+#if FLW_MODE == FLW_MODE_COUNTER
+#define FLW 5          // T1 : Timer1 external clock input
+#define FLW_GATE_MS 250  // Flow rate (frequency) measuring period
+#else
 #define FLW 2
+#endif
+#define FLW_K_FACTOR 8.1       // Default sensor frequency (Hz) per L/min, runtime value in settings
+#define FLW_NOMINAL_RATE 5.0  // Default L/min, flow below this rate is timed in dispense statistics
+// Glitch filter, evaluated in flowmeter_read() (FLW_MODE_ISR only)
+#define FLW_MIN_PULSE_US  500   // A pulse staying high less than this is a glitch
+#define FLW_MIN_PERIOD_US 2000  // Pulses closer than this exceed the sensor max frequency (500 Hz)
+// Self protection : above FLW_MAX_EDGES edges in FLW_EDGE_WINDOW_US the pin interrupt is masked for FLW_MASK_MS
+#define FLW_EDGE_WINDOW_US 100000
+#define FLW_MAX_EDGES      200
+#define FLW_MASK_MS        500
+
+// Recipes : ordered volume steps, edited with RECIPE serial command
+#define RECIPE_NB        3
+#define RECIPE_MAX_STEPS 6
+
+// Power fail detection : raw supply divider on AIN1 (D7), see powerfail.h
+#define PWR_FAIL_DETECT 0  // 1 once the divider is wired, AIN1 floats without it
+#define PWR_FAIL_ARM_MS 500      // Detection armed this long after valve opens (inrush)
+#define PWR_FAIL_RECOVER_MS 500  // Supply back this long after a trip ends the run
+
+// Logging (see log.h) : LOG_LEVEL_NONE, LOG_LEVEL_ERROR, LOG_LEVEL_INFO or LOG_LEVEL_DEBUG
+#define LOG_LEVEL LOG_LEVEL_INFO
+#define LOG_BUFFER_SIZE 16  // Entries, power of 2
+#define LOG_LINE_MAX    48  // Room needed in serial TX buffer to print an entry
+
+// Serial command interface
+#define SERIAL_CMD_MAX_LEN 64  // Longest accepted command line, terminator excluded
+#define SERIAL_MAX_LATENCY_US 80000  // Command to valve action worst case : LCD refresh and a run start save
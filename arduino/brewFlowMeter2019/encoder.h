@@ -45,16 +45,9 @@ void encoder_read() {
     } else { // Otherwise B changed first and we're moving CCW
       encoderPosCount = -1;
     }
-    // ---- Values sent to serial only in testing_mode ----
+    // ---- Values logged only in testing_mode ----
     if (testing_mode) {
-      Serial.print ("Rotated: ");
-      if (encoderPosCount > 0) {
-        Serial.println ("clockwise");
-      } else {
-        Serial.println("counterclockwise");
-      }
-      Serial.print("Encoder Position: ");
-      Serial.println(encoderPosCount);
+      LOG_DEBUG(LOG_ENC_ROTATED, encoderPosCount);
     }
     // -----------------------------------------------------
   }
@@ -71,7 +64,7 @@ void encoder_button_pushed() {
   if (digitalRead(ENC_SW) == LOW) {
     button_was_pushed = true;
     if (testing_mode)  {
-      Serial.println("Encoder Button was pushed !");
+      LOG_DEBUG(LOG_ENC_PUSHED);
     }
   }
 }
@@ -1,10 +1,4 @@
 #include <PinChangeInt.h>
-#include <EEPROM.h>
-
-// Constants for eeprom addresses
-#define EEPROM_TOTAL_PULSES_ADDR 0
-#define EEPROM_CURRENT_PULSES_ADDR 8
-#define EEPROM_TARGET_LITERS_ADDR 16
 
 // Liquid Flow meter variables
 // count how many flw_pulses!
@@ -19,6 +13,23 @@ volatile uint8_t flw_last_pinstate;
 volatile uint32_t flw_last_ratetimer = 0;
 // and use that to calculate a flow rate
 volatile float flw_rate;
+// timestamp (micros) of the last low to high transition
+volatile uint32_t flw_last_pulse_us = 0;
+// mean period (micros) of the last counted pulses
+volatile uint32_t flw_pulse_period_us = 0;
+// timestamp (micros) of the last rising edge, the pulse is judged on falling edge
+volatile uint32_t flw_rise_us = 0;
+volatile boolean flw_rise_seen = false;
+// Glitch filter diagnostics : rejected pulses (too short high level, too high frequency)
+// and number of times the interrupt was masked by self protection
+volatile uint16_t flw_rejected_width = 0;
+volatile uint16_t flw_rejected_rate = 0;
+volatile uint16_t flw_mask_count = 0;
+// Self protection : edges seen in the current window, masking state
+volatile uint32_t flw_window_start_us = 0;
+volatile uint16_t flw_window_edges = 0;
+volatile boolean flw_masked = false;
+volatile uint32_t flw_masked_at = 0;
 
 // Expose these variables to application
 // Target of number of liter to deliver
@@ -28,34 +39,26 @@ float flowmeter_liters, flowmeter_total_liters;
 boolean flowmeter_was_turning = false;
 
 /*************************************************
-   Writing a float in EEPROM
+   Deleting all stored values
  **************************************************/
-void eeprom_write(int addr, float f) {
-  unsigned char *buf = (unsigned char*)(&f);
-  for ( int i = 0 ; i < (int)sizeof(f) ; i++ ) {
-    EEPROM.write(addr + i, buf[i]);
-  }
+void flowmeter_reset() {
+  settings.pulses = 0;
+  settings.total_pulses = 0;
+  settings.target_liters = 0;
+  settings.dispensing = 0;
+  settings_save();
 }
 
 /*************************************************
-   Reading a float from EEPROM
+   Saving counters and target liters in EEPROM
  **************************************************/
-float eeprom_read(int addr) {
-  float f;
-  unsigned char *buf = (unsigned char*)(&f);
-  for ( int i = 0 ; i < (int)sizeof(f) ; i++ ) {
-    buf[i] = EEPROM.read(addr + i);
-  }
-  return f;
-}
-
-/*************************************************
-   Deleting all stored values
- **************************************************/
-void flowmeter_reset() {
-  eeprom_write(EEPROM_CURRENT_PULSES_ADDR, 0);
-  eeprom_write(EEPROM_TOTAL_PULSES_ADDR, 0);
-  eeprom_write(EEPROM_TARGET_LITERS_ADDR, 0);
+void flowmeter_save() {
+  noInterrupts();
+  settings.pulses = flw_pulses;
+  settings.total_pulses = flw_total_pulses;
+  interrupts();
+  settings.target_liters = app_target_liters;
+  settings_save();
 }
 
 /*************************************************
@@ -63,7 +66,7 @@ void flowmeter_reset() {
    of a predefined step
  **************************************************/
 void flowmeter_calculate_target_liters() {
-  app_target_liters += encoderPosCount * ENC_STEP;
+  app_target_liters += encoderPosCount * settings.enc_step;
   if ( app_target_liters < 0 ) {
     app_target_liters = 0;
   }
@@ -83,14 +86,14 @@ void flowmeter_calculate_pct_of_target_liters() {
   volume calculations
 **************************************************/
 float calculateLiters(uint16_t p) {
-  // Sensor Frequency (Hz) = 7.5 * Q (Liters/min)
+  // Sensor Frequency (Hz) = K * Q (Liters/min), K is settings.k_factor
   // Liters = Q * time elapsed (seconds) / 60 (seconds/minute)
-  // Liters = (Frequency (flw_pulses/second) / 7.5) * time elapsed (seconds) / 60
-  // Liters = flw_pulses / (7.5 * 60)
+  // Liters = (Frequency (flw_pulses/second) / K) * time elapsed (seconds) / 60
+  // Liters = flw_pulses / (K * 60)
   // if a brass sensor use the following calculation
   if (p > 0) {
     float l = p;
-    l /= 8.1;
+    l /= settings.k_factor;
     //??????? Need to be precised ????    l -= 6;
     l /= 60.0;
     return l;
@@ -98,44 +101,230 @@ float calculateLiters(uint16_t p) {
   return 0;
 }
 
+/*************************************************
+   Number of pulses for a volume (inverse of
+   calculateLiters)
+ **************************************************/
+uint16_t flowmeter_pulses_for_liters(float l) {
+  return (uint16_t)(l * settings.k_factor * 60.0 + 0.5);
+}
+
+/*************************************************
+   Counting a batch of new pulses
+ **************************************************/
+void flowmeter_add_pulses(uint16_t n, uint32_t at) {
+  flw_pulse_period_us = (at - flw_last_pulse_us) / n;
+  flw_total_pulses += n;
+  flw_pulses += n;
+  flw_last_pulse_us = at;
+  flowmeter_was_turning = true;
+  flowmeter_liters = calculateLiters(flw_pulses);
+  flowmeter_total_liters = calculateLiters(flw_total_pulses);
+}
+
+/*************************************************
+   Flow rate (L/min) from pulse timestamps. Time
+   since the last pulse bounds the period, so the
+   rate falls to zero when flow stops.
+ **************************************************/
+float flowmeter_rate_lpm() {
+  noInterrupts();
+  uint32_t period = flw_pulse_period_us;
+  uint32_t last = flw_last_pulse_us;
+  interrupts();
+  uint32_t idle = micros() - last;
+  if (idle > period) {
+    period = idle;
+  }
+  if (period == 0) {
+    return 0;
+  }
+  return calculateLiters(1) * 60000000.0 / period;
+}
+
+#if FLW_MODE == FLW_MODE_COUNTER
+// Hardware counter mode : Timer1 counts the sensor rising edges on T1,
+// no interrupt at all. The count is read on every main loop pass, so
+// target checks lag by one pass only, flw_rate is computed over FLW_GATE_MS.
+uint16_t flw_last_count = 0;
+uint16_t flw_gate_count = 0;
+uint32_t flw_last_gate_us = 0;
+uint32_t flw_last_gate_ms = 0;
+
+/*************************************************
+   Reading Timer1 counter (16 bits, atomic)
+ **************************************************/
+uint16_t flowmeter_counter() {
+  noInterrupts();
+  uint16_t c = TCNT1;
+  interrupts();
+  return c;
+}
+
+/*************************************************
+   Sampling hardware counter (called from main
+   loop), frequency at the end of each gate period.
+   Pulses are never lost while the loop is late,
+   they wait in TCNT1 (up to 65535 per sample).
+ **************************************************/
+void flowmeter_sample_counter() {
+  uint32_t now = micros();
+  uint16_t count = flowmeter_counter();
+  uint16_t n = count - flw_last_count;
+  if (n > 0) {
+    flw_last_count = count;
+    flowmeter_add_pulses(n, now);
+  }
+  if (millis() - flw_last_gate_ms >= FLW_GATE_MS) {
+    flw_last_gate_ms = millis();
+    flw_rate = (uint16_t)(count - flw_gate_count) * 1000000.0 / (now - flw_last_gate_us); // in hertz
+    flw_gate_count = count;
+    flw_last_gate_us = now;
+  }
+}
+
+/*************************************************
+   Setup Timer1 : external clock on T1, rising edge
+ **************************************************/
+void flowmeter_setup_counter() {
+  pinMode(FLW, INPUT_PULLUP);
+  noInterrupts();
+  TCCR1A = 0;
+  TCCR1B = _BV(CS12) | _BV(CS11) | _BV(CS10);
+  TIMSK1 = 0;
+  TCNT1 = 0;
+  interrupts();
+  flw_last_count = 0;
+  flw_gate_count = 0;
+  flw_last_gate_ms = millis();
+  flw_last_gate_us = micros();
+}
+
+#else
+/*************************************************
+   Masking / unmasking the flowsensor pin change
+   interrupt directly in PCMSK register, which is
+   safe from inside the interrupt handler.
+   PinChangeInt may still call flowmeter_read() for
+   another pin of the port (encoder CLK), so the
+   handler also checks flw_masked.
+ **************************************************/
+void flowmeter_mask_interrupt() {
+  *digitalPinToPCMSK(FLW) &= ~_BV(digitalPinToPCMSKbit(FLW));
+}
+
+void flowmeter_unmask_interrupt() {
+  *digitalPinToPCMSK(FLW) |= _BV(digitalPinToPCMSKbit(FLW));
+}
+
 /*************************************************
    interruptions for flowsensor reading.
+   A pulse is counted on its falling edge, from the
+   timestamps of its own edges :
+   - a high level shorter than FLW_MIN_PULSE_US is noise,
+   - a rising edge sooner than FLW_MIN_PERIOD_US after
+     the previous pulse is faster than the sensor can go,
+   - more than FLW_MAX_EDGES edges in FLW_EDGE_WINDOW_US
+     masks the interrupt (see flowmeter_check_protection).
  **************************************************/
 void flowmeter_read() {
+  if (flw_masked) {
+    return; // called for another pin of the port
+  }
+  uint32_t now = micros();
+
+  // Self protection against edges storms
+  if (now - flw_window_start_us >= FLW_EDGE_WINDOW_US) {
+    flw_window_start_us = now;
+    flw_window_edges = 0;
+  }
+  if (++flw_window_edges > FLW_MAX_EDGES) {
+    flowmeter_mask_interrupt();
+    flw_masked = true;
+    flw_masked_at = millis();
+    flw_mask_count++;
+    return;
+  }
+
   uint8_t x = digitalRead(FLW);
   if (x == flw_last_pinstate) {
     flw_last_ratetimer++;
     flw_pulses_old = flw_pulses;
     return; // nothing changed!
   }
+  flw_last_pinstate = x;
   if (x == HIGH) {
-    //low to high transition!
-    flw_total_pulses++;
-    flw_pulses++;
-    flowmeter_was_turning = true;
-    flowmeter_liters = calculateLiters(flw_pulses);
-    flowmeter_total_liters = calculateLiters(flw_total_pulses);
+    //low to high transition, pulse starts
+    flw_rise_us = now;
+    flw_rise_seen = true;
+    return;
   }
-  flw_last_pinstate = x;
+  //high to low transition, pulse ends
+  if (!flw_rise_seen) {
+    return; // started while masked or before setup
+  }
+  flw_rise_seen = false;
+  if (now - flw_rise_us < FLW_MIN_PULSE_US) {
+    flw_rejected_width++;
+    return; // glitch, high level did not last
+  }
+  if (flw_rise_us - flw_last_pulse_us < FLW_MIN_PERIOD_US) {
+    flw_rejected_rate++;
+    return; // glitch, faster than sensor
+  }
+  flowmeter_add_pulses(1, flw_rise_us);
   flw_rate = 1000.0;
   flw_rate /= flw_last_ratetimer; // in hertz
   flw_last_ratetimer = 0;
 }
 
+/*************************************************
+   Unmasking the flowsensor interrupt once self
+   protection delay is over (called from main loop)
+ **************************************************/
+void flowmeter_check_protection() {
+  if (flw_masked && millis() - flw_masked_at >= FLW_MASK_MS) {
+    noInterrupts();
+    flw_last_pinstate = digitalRead(FLW);
+    flw_rise_seen = false;
+    flw_window_start_us = micros();
+    flw_window_edges = 0;
+    flw_masked = false;
+    flowmeter_unmask_interrupt();
+    interrupts();
+  }
+}
+#endif
+
+/*************************************************
+   Flowmeter acquisition tasks of the main loop
+ **************************************************/
+void flowmeter_update() {
+#if FLW_MODE == FLW_MODE_COUNTER
+  flowmeter_sample_counter();
+#else
+  flowmeter_check_protection();
+#endif
+}
+
 /*************************************************
    Setup flowmeter (to be included in general setup)
  **************************************************/
 void flowmeter_setup() {
   // Liquid Flow meter settings
+#if FLW_MODE == FLW_MODE_COUNTER
+  flowmeter_setup_counter();
+#else
   pinMode(FLW, INPUT_PULLUP);
   attachPinChangeInterrupt(FLW, flowmeter_read, CHANGE);
   flw_last_pinstate = HIGH;
   flowmeter_read();
+#endif
 
-  // Read saved values from eeprom
-  flw_pulses = eeprom_read(EEPROM_CURRENT_PULSES_ADDR);
-  flw_total_pulses = eeprom_read(EEPROM_TOTAL_PULSES_ADDR);
-  app_target_liters = eeprom_read(EEPROM_TARGET_LITERS_ADDR);
+  // Saved values, from settings loaded at boot
+  flw_pulses = settings.pulses;
+  flw_total_pulses = settings.total_pulses;
+  app_target_liters = settings.target_liters;
   
   // Init variables
   flw_pulses_old = flw_pulses;
@@ -0,0 +1,229 @@
+// Dispense flow statistics
+// Computed on the fly in constant memory while APP_RUNNING :
+// mean / variance (Welford running moments), min, max,
+// median and 90th percentile (P² estimator, Jain & Chlamtac 1985)
+// and time spent below nominal rate (settings.nominal_rate).
+// One observation is the mean flow rate (L/min) between two pulse
+// timestamps sampled by the main loop.
+
+// P² quantile estimator : 5 markers, no sample storage.
+struct p2_quantile {
+  float p;        // Quantile to estimate (0..1)
+  uint32_t count; // Number of observations
+  float q[5];     // Marker heights
+  uint32_t n[5];  // Actual marker positions, increasing
+  float np[5];    // Desired marker positions
+  float dn[5];    // Desired positions increments
+};
+
+// Statistics of the current (or last) dispense
+uint32_t flst_count;
+float flst_mean, flst_m2, flst_min, flst_max;
+// Time below nominal in ms (micros would wrap after 71 minutes), and the
+// microseconds not yet carried to it
+uint32_t flst_below_nominal_ms;
+uint16_t flst_below_nominal_rest_us;
+p2_quantile flst_median, flst_p90;
+// Last sampled pulse, origin of the next observation
+uint16_t flst_last_pulses;
+uint32_t flst_last_pulse_us;
+
+/*************************************************
+   P² : Init estimator for quantile p
+ **************************************************/
+void p2_init(p2_quantile *e, float p) {
+  e->p = p;
+  e->count = 0;
+  for (int i = 0; i < 5; i++) {
+    e->q[i] = 0;
+    e->n[i] = i;
+  }
+  e->np[0] = 0;
+  e->np[1] = 2 * p;
+  e->np[2] = 4 * p;
+  e->np[3] = 2 + 2 * p;
+  e->np[4] = 4;
+  e->dn[0] = 0;
+  e->dn[1] = p / 2;
+  e->dn[2] = p;
+  e->dn[3] = (1 + p) / 2;
+  e->dn[4] = 1;
+}
+
+/*************************************************
+   P² : Adding an observation
+ **************************************************/
+void p2_add(p2_quantile *e, float x) {
+  // Five first observations are kept sorted in markers
+  if (e->count < 5) {
+    int i = e->count;
+    while (i > 0 && e->q[i - 1] > x) {
+      e->q[i] = e->q[i - 1];
+      i--;
+    }
+    e->q[i] = x;
+    e->count++;
+    return;
+  }
+  e->count++;
+
+  // Find the cell k where x falls, adjusting extremes
+  int k;
+  if (x < e->q[0]) {
+    e->q[0] = x;
+    k = 0;
+  } else if (x >= e->q[4]) {
+    e->q[4] = x;
+    k = 3;
+  } else {
+    k = 0;
+    while (x >= e->q[k + 1]) {
+      k++;
+    }
+  }
+  for (int i = k + 1; i < 5; i++) {
+    e->n[i]++;
+  }
+  for (int i = 0; i < 5; i++) {
+    e->np[i] += e->dn[i];
+  }
+
+  // Adjust middle markers heights if they are off their desired position
+  for (int i = 1; i < 4; i++) {
+    float d = e->np[i] - e->n[i];
+    // Gaps to neighbour markers, positive as positions are increasing
+    int32_t below = e->n[i] - e->n[i - 1];
+    int32_t above = e->n[i + 1] - e->n[i];
+    if ((d >= 1 && above > 1) || (d <= -1 && below > 1)) {
+      int s = (d > 0) ? 1 : -1;
+      // Piecewise parabolic prediction
+      float qp = e->q[i] + (float)s / (above + below) *
+                 ((below + s) * (e->q[i + 1] - e->q[i]) / above +
+                  (above - s) * (e->q[i] - e->q[i - 1]) / below);
+      if (e->q[i - 1] < qp && qp < e->q[i + 1]) {
+        e->q[i] = qp;
+      } else {
+        // Linear prediction
+        e->q[i] += s * (e->q[i + s] - e->q[i]) / (s > 0 ? above : -below);
+      }
+      e->n[i] += s;
+    }
+  }
+}
+
+/*************************************************
+   P² : Current estimation of the quantile
+ **************************************************/
+float p2_value(p2_quantile *e) {
+  if (e->count == 0) {
+    return 0;
+  }
+  if (e->count < 5) {
+    // Not enough observations, nearest rank on sorted ones
+    return e->q[(int)(e->p * (e->count - 1) + 0.5)];
+  }
+  return e->q[2];
+}
+
+/*************************************************
+   Taking current pulse as origin of the next
+   observation, so time spent valve closed (recipe
+   pause) is not measured as a slow flow
+ **************************************************/
+void flowstats_resume() {
+  noInterrupts();
+  flst_last_pulses = flw_pulses;
+  flst_last_pulse_us = micros();
+  interrupts();
+}
+
+/*************************************************
+   Reset statistics, to be called when a dispense
+   starts
+ **************************************************/
+void flowstats_reset() {
+  flst_count = 0;
+  flst_mean = 0;
+  flst_m2 = 0;
+  flst_min = 0;
+  flst_max = 0;
+  flst_below_nominal_ms = 0;
+  flst_below_nominal_rest_us = 0;
+  p2_init(&flst_median, 0.5);
+  p2_init(&flst_p90, 0.9);
+  flowstats_resume();
+}
+
+/*************************************************
+   Adding time spent below nominal rate
+ **************************************************/
+void flowstats_add_below_nominal(uint32_t us) {
+  us += flst_below_nominal_rest_us;
+  flst_below_nominal_ms += us / 1000;
+  flst_below_nominal_rest_us = us % 1000;
+}
+
+/*************************************************
+   Adding an observation of flow rate (L/min)
+   that lasted dt microseconds
+ **************************************************/
+void flowstats_add(float rate, uint32_t dt) {
+  flst_count++;
+  float delta = rate - flst_mean;
+  flst_mean += delta / flst_count;
+  flst_m2 += delta * (rate - flst_mean);
+  if (flst_count == 1 || rate < flst_min) {
+    flst_min = rate;
+  }
+  if (flst_count == 1 || rate > flst_max) {
+    flst_max = rate;
+  }
+  if (rate < settings.nominal_rate) {
+    flowstats_add_below_nominal(dt);
+  }
+  p2_add(&flst_median, rate);
+  p2_add(&flst_p90, rate);
+}
+
+/*************************************************
+   Sampling pulses counted since last call,
+   to be called from the main loop while running
+ **************************************************/
+void flowstats_sample() {
+  noInterrupts();
+  uint16_t pulses = flw_pulses;
+  uint32_t pulse_us = flw_last_pulse_us;
+  interrupts();
+
+  uint16_t dp = pulses - flst_last_pulses;
+  uint32_t dt = pulse_us - flst_last_pulse_us;
+  if (dp == 0 || dt == 0) {
+    return;
+  }
+  // liters in the window, scaled to one minute
+  float rate = calculateLiters(dp) * 60000000.0 / dt;
+  flowstats_add(rate, dt);
+  flst_last_pulses = pulses;
+  flst_last_pulse_us = pulse_us;
+}
+
+/*************************************************
+   Closing statistics when the valve closes : time
+   since the last pulse had no flow at all
+ **************************************************/
+void flowstats_close() {
+  flowstats_sample();
+  if (settings.nominal_rate > 0) {
+    flowstats_add_below_nominal(micros() - flst_last_pulse_us);
+  }
+}
+
+/*************************************************
+   Standard deviation of flow rate
+ **************************************************/
+float flowstats_stddev() {
+  if (flst_count < 2) {
+    return 0;
+  }
+  return sqrt(flst_m2 / (flst_count - 1));
+}
@@ -0,0 +1,179 @@
+// Deferred logging
+// LOG_ERROR / LOG_INFO / LOG_DEBUG (message id, up to 2 int arguments)
+// only store an entry in a ring buffer, so they can be called from
+// interrupt handlers. log_flush(), from the main loop, prints entries
+// while the serial TX buffer has room for a whole line, it never waits.
+// Levels above LOG_LEVEL are removed at compile time.
+
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+
+// Message ids, same order as log_messages, grouped by level : ids and
+// strings of the levels above LOG_LEVEL are not built
+enum {
+  // LOG_ERROR
+  LOG_UNKNOWN_STATE,      // state
+  LOG_SETTINGS_DEFAULTS,
+  LOG_RUN_UNKNOWN,
+  LOG_SERIAL_LATE,        // latency in ms
+  LOG_DROPPED,            // nb of entries
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+  LOG_STATE,              // from, to
+  LOG_SETTINGS_MIGRATED,  // from version
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+  LOG_CHOICE,             // screen choice
+  LOG_ENC_ROTATED,        // encoder position
+  LOG_ENC_PUSHED,
+#endif
+};
+
+#if LOG_LEVEL > LOG_LEVEL_NONE
+
+const char log_msg_unknown_state[] PROGMEM = "Unknown state";
+const char log_msg_settings_defaults[] PROGMEM = "Settings invalid, defaults applied";
+const char log_msg_run_unknown[] PROGMEM = "Interrupted run without power fail record";
+const char log_msg_serial_late[] PROGMEM = "Serial command late, ms";
+const char log_msg_dropped[] PROGMEM = "Log entries dropped";
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+const char log_msg_state[] PROGMEM = "State";
+const char log_msg_settings_migrated[] PROGMEM = "Settings migrated from v";
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+const char log_msg_choice[] PROGMEM = "Choice";
+const char log_msg_enc_rotated[] PROGMEM = "Encoder rotated";
+const char log_msg_enc_pushed[] PROGMEM = "Encoder button pushed";
+#endif
+
+const char *const log_messages[] PROGMEM = {
+  log_msg_unknown_state,
+  log_msg_settings_defaults,
+  log_msg_run_unknown,
+  log_msg_serial_late,
+  log_msg_dropped,
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+  log_msg_state,
+  log_msg_settings_migrated,
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+  log_msg_choice,
+  log_msg_enc_rotated,
+  log_msg_enc_pushed,
+#endif
+};
+
+const char log_level_letters[] = "?EID";
+
+struct log_entry_t {
+  uint8_t level;
+  uint8_t id;
+  uint8_t nb_args;
+  int16_t args[2];
+};
+
+// Ring buffer, LOG_BUFFER_SIZE must be a power of 2
+log_entry_t log_buffer[LOG_BUFFER_SIZE];
+volatile uint8_t log_head = 0;  // Next entry to write
+volatile uint8_t log_tail = 0;  // Next entry to print
+volatile uint16_t log_dropped = 0;
+
+/*************************************************
+   Storing an entry, from any context
+ **************************************************/
+void log_push(uint8_t level, uint8_t id, uint8_t nb_args, int16_t arg1, int16_t arg2) {
+  uint8_t sreg = SREG;
+  noInterrupts();
+  uint8_t next = (log_head + 1) & (LOG_BUFFER_SIZE - 1);
+  if (next == log_tail) {
+    log_dropped++;
+  } else {
+    log_entry_t *e = &log_buffer[log_head];
+    e->level = level;
+    e->id = id;
+    e->nb_args = nb_args;
+    e->args[0] = arg1;
+    e->args[1] = arg2;
+    log_head = next;
+  }
+  SREG = sreg;
+}
+
+void log_push(uint8_t level, uint8_t id) {
+  log_push(level, id, 0, 0, 0);
+}
+
+void log_push(uint8_t level, uint8_t id, int16_t arg1) {
+  log_push(level, id, 1, arg1, 0);
+}
+
+void log_push(uint8_t level, uint8_t id, int16_t arg1, int16_t arg2) {
+  log_push(level, id, 2, arg1, arg2);
+}
+
+/*************************************************
+   Printing one entry
+ **************************************************/
+void log_print(const log_entry_t *e) {
+  Serial.print(log_level_letters[e->level]);
+  Serial.print(' ');
+  Serial.print((const __FlashStringHelper *)pgm_read_ptr(&log_messages[e->id]));
+  for (uint8_t i = 0; i < e->nb_args; i++) {
+    Serial.print(' ');
+    Serial.print(e->args[i]);
+  }
+  Serial.println();
+}
+
+/*************************************************
+   Printing stored entries while serial port has
+   room (to be called from main loop)
+ **************************************************/
+void log_flush() {
+  while (Serial.availableForWrite() >= LOG_LINE_MAX) {
+    log_entry_t e;
+    noInterrupts();
+    if (log_tail == log_head) {
+      uint16_t dropped = log_dropped;
+      log_dropped = 0;
+      interrupts();
+      if (dropped > 0) {
+        e.level = LOG_LEVEL_ERROR;
+        e.id = LOG_DROPPED;
+        e.nb_args = 1;
+        e.args[0] = dropped;
+        log_print(&e);
+      }
+      return;
+    }
+    e = log_buffer[log_tail];
+    log_tail = (log_tail + 1) & (LOG_BUFFER_SIZE - 1);
+    interrupts();
+    log_print(&e);
+  }
+}
+
+#else
+
+void log_flush() {}
+
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) log_push(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) log_push(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) log_push(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
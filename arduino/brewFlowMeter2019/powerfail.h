@@ -0,0 +1,159 @@
+// Power fail detection and dispense resume
+// While APP_RUNNING counters only live in RAM. Settings are saved when
+// the run starts (dispensing flag set) and when it ends (flag cleared).
+// Detection is armed only while a run started by powerfail_run_started()
+// is dispensing, PWR_FAIL_ARM_MS after it (valve inrush), and disarmed
+// before any other eeprom write : the interrupt writes would corrupt it. If supply drops, the analog comparator interrupt
+// writes the run pulses in a 3 bytes record, marker last, so a record cut
+// by the power loss is never valid, and flags the trip : the main loop
+// closes the valve and ends the run once supply is back.
+// Wiring : raw supply through a divider on AIN1 (D7), compared to the
+// 1.1 V bandgap. Choose the divider so AIN1 is 1.1 V at the chosen
+// threshold, and a bulk capacitor keeping the Arduino alive about 15 ms
+// after it.
+
+// POWERFAIL_ADDR is in settings.h, next to the block it follows
+#define POWERFAIL_MARKER 0xA5
+
+// Record written from the interrupt
+struct powerfail_t {
+  uint16_t pulses;
+  uint8_t marker;        // Written last
+};
+
+// True at boot when an interrupted run can be resumed
+boolean powerfail_resume_offered = false;
+// Set by the interrupt, handled by the main loop
+volatile boolean powerfail_tripped = false;
+// A run is dispensing since powerfail_run_started(), not an interrupted one
+boolean powerfail_running = false;
+// millis() when the run started, arming is delayed from it
+uint32_t powerfail_run_start;
+// millis() since supply is back over threshold after a trip
+uint32_t powerfail_supply_ok_since;
+
+/*************************************************
+   Arming / disarming detection
+ **************************************************/
+void powerfail_arm() {
+#if PWR_FAIL_DETECT
+  ACSR |= _BV(ACI);  // clears a pending trip
+  ACSR |= _BV(ACIE);
+#endif
+}
+
+void powerfail_disarm() {
+  ACSR &= ~_BV(ACIE);
+}
+
+boolean powerfail_armed() {
+  return ACSR & _BV(ACIE);
+}
+
+/*************************************************
+   Supply is dropping : analog comparator output
+   rises when AIN1 goes under bandgap.
+ **************************************************/
+ISR(ANALOG_COMP_vect) {
+  // One shot, main loop ends the run
+  powerfail_disarm();
+  powerfail_tripped = true;
+  uint16_t pulses = flw_pulses;
+  EEPROM.write(POWERFAIL_ADDR + offsetof(powerfail_t, pulses), pulses & 0xFF);
+  EEPROM.write(POWERFAIL_ADDR + offsetof(powerfail_t, pulses) + 1, pulses >> 8);
+  EEPROM.write(POWERFAIL_ADDR + offsetof(powerfail_t, marker), POWERFAIL_MARKER);
+}
+
+/*************************************************
+   Invalidating power fail record
+ **************************************************/
+void powerfail_clear() {
+  EEPROM.update(POWERFAIL_ADDR + offsetof(powerfail_t, marker), 0);
+}
+
+/*************************************************
+   Saving counters when a run starts, nothing else
+   is written in eeprom until it ends
+ **************************************************/
+void powerfail_run_started() {
+  powerfail_clear();
+  settings.dispensing = 1;
+  flowmeter_save();
+  powerfail_resume_offered = false;
+  powerfail_tripped = false;
+  powerfail_run_start = millis();
+  powerfail_running = true;
+}
+
+/*************************************************
+   Saving counters when a run ends
+ **************************************************/
+void powerfail_run_ended() {
+  powerfail_disarm();
+  powerfail_running = false;
+  settings.dispensing = 0;
+  flowmeter_save();
+  powerfail_resume_offered = false;
+}
+
+/*************************************************
+   Restoring counters of a run interrupted by a
+   power loss (after flowmeter setup)
+ **************************************************/
+void powerfail_check_interrupted_run() {
+  if (!settings.dispensing) {
+    return;
+  }
+  powerfail_t record;
+  EEPROM.get(POWERFAIL_ADDR, record);
+  if (record.marker != POWERFAIL_MARKER) {
+    // Pulses of the run are unknown, resuming could overflow target
+    LOG_ERROR(LOG_RUN_UNKNOWN);
+    powerfail_run_ended();
+    return;
+  }
+  flw_total_pulses = settings.total_pulses + (uint16_t)(record.pulses - settings.pulses);
+  flw_pulses = record.pulses;
+  flw_pulses_old = flw_pulses;
+  flowmeter_liters = calculateLiters(flw_pulses);
+  flowmeter_total_liters = calculateLiters(flw_total_pulses);
+  powerfail_resume_offered = true;
+}
+
+/*************************************************
+   Setup power fail detection (to be included in
+   general setup, after flowmeter setup)
+ **************************************************/
+void powerfail_setup() {
+  powerfail_check_interrupted_run();
+#if PWR_FAIL_DETECT
+  // AIN1 as negative input, bandgap as positive one,
+  ADCSRB &= ~_BV(ACME);
+  DIDR1 |= _BV(AIN1D);
+  // interrupt on rising output, armed by powerfail_update()
+  ACSR = _BV(ACBG) | _BV(ACI) | _BV(ACIS1) | _BV(ACIS0);
+#endif
+}
+
+/*************************************************
+   Arming detection once the run is settled, and
+   watching supply after a trip (called from main
+   loop). Returns true once supply has been back
+   for PWR_FAIL_RECOVER_MS after a trip.
+ **************************************************/
+boolean powerfail_update() {
+  if (powerfail_tripped) {
+    // ACO is high while AIN1 is under bandgap
+    if (ACSR & _BV(ACO)) {
+      powerfail_supply_ok_since = millis();
+    } else if (millis() - powerfail_supply_ok_since >= PWR_FAIL_RECOVER_MS) {
+      powerfail_tripped = false;
+      return true;
+    }
+    return false;
+  }
+  if (powerfail_running && !powerfail_armed() && millis() - powerfail_run_start >= PWR_FAIL_ARM_MS) {
+    powerfail_arm();
+  }
+  return false;
+}
@@ -0,0 +1,190 @@
+// Recipe sequencer
+// A recipe is an ordered list of volume steps stored in settings, each
+// one after an optional pause (valve closed, timed or until a push).
+// Steps without pause follow each other with the valve kept open.
+// The recipe is saved in settings with the dispensing flag, so a run
+// interrupted by a power loss resumes at the step it was in.
+// Transitions are pipelined : while a step runs, the main loop prepares
+// the next step pulse threshold and screen line, so reaching the
+// threshold only swaps prepared values.
+
+// Sequencer state
+boolean recipe_active = false;
+uint8_t recipe_index;           // Recipe being run
+uint8_t recipe_step;            // Current step
+uint8_t recipe_nb_steps;
+float recipe_saved_target;      // app_target_liters before the recipe, restored after
+uint16_t recipe_base_pulses;    // flw_pulses when recipe started
+float recipe_base_liters;
+// Current step
+uint16_t recipe_end_pulses;     // Pulses since recipe start ending the step
+uint16_t recipe_pause_s;        // Pause before the step
+uint32_t recipe_pause_start;    // millis() when pause started
+uint32_t recipe_pause_refresh;  // millis() of last countdown display
+String recipe_line;             // LCD first line while step runs
+// Next step, prepared while current step runs
+boolean recipe_next_ready = false;
+uint8_t recipe_next_step;
+uint16_t recipe_next_end_pulses;
+uint16_t recipe_next_pause_s;
+String recipe_next_line;
+
+/*************************************************
+   Number of steps in a recipe
+ **************************************************/
+uint8_t recipe_count_steps(uint8_t n) {
+  uint8_t i = 0;
+  while (i < RECIPE_MAX_STEPS && settings.recipes[n][i].liters > 0) {
+    i++;
+  }
+  return i;
+}
+
+/*************************************************
+   Total volume of a recipe
+ **************************************************/
+float recipe_total_liters(uint8_t n) {
+  float l = 0;
+  for (uint8_t i = 0; i < recipe_count_steps(n); i++) {
+    l += settings.recipes[n][i].liters;
+  }
+  return l;
+}
+
+/*************************************************
+   True if a recipe volume can be counted from its
+   start in 16 bits pulses
+ **************************************************/
+boolean recipe_fits(float liters) {
+  return liters * settings.k_factor * 60 <= 65535;
+}
+
+/*************************************************
+   Preparing step values ahead of the transition.
+   Thresholds are cumulated from recipe start so
+   rounding does not drift along steps.
+ **************************************************/
+void recipe_prepare(uint8_t step) {
+  float l = 0;
+  for (uint8_t i = 0; i <= step; i++) {
+    l += settings.recipes[recipe_index][i].liters;
+  }
+  recipe_next_step = step;
+  recipe_next_end_pulses = flowmeter_pulses_for_liters(l);
+  recipe_next_pause_s = settings.recipes[recipe_index][step].pause_s;
+  recipe_next_line = "Step " + String(step + 1) + "/" + String(recipe_nb_steps) + " " +
+                     String(settings.recipes[recipe_index][step].liters) + " L    ";
+  recipe_next_ready = true;
+}
+
+/*************************************************
+   Switching to prepared step
+ **************************************************/
+void recipe_advance() {
+  recipe_step = recipe_next_step;
+  recipe_end_pulses = recipe_next_end_pulses;
+  recipe_pause_s = recipe_next_pause_s;
+  recipe_line = recipe_next_line;
+  recipe_next_ready = false;
+  // Target of the step, in absolute liters like app_target_liters
+  app_target_liters = recipe_base_liters + calculateLiters(recipe_end_pulses);
+}
+
+/*************************************************
+   Starting recipe n, returns false if it is empty
+   or too large for the current K factor
+ **************************************************/
+boolean recipe_start(uint8_t n) {
+  recipe_nb_steps = recipe_count_steps(n);
+  if (recipe_nb_steps == 0 || !recipe_fits(recipe_total_liters(n))) {
+    return false;
+  }
+  recipe_index = n;
+  recipe_saved_target = app_target_liters;
+  noInterrupts();
+  recipe_base_pulses = flw_pulses;
+  interrupts();
+  recipe_base_liters = calculateLiters(recipe_base_pulses);
+  recipe_prepare(0);
+  recipe_advance();
+  recipe_active = true;
+  // Saved when the run starts
+  settings.recipe_running = n + 1;
+  settings.recipe_base_pulses = recipe_base_pulses;
+  settings.recipe_saved_target = recipe_saved_target;
+  // One dispense for the whole recipe
+  flowstats_reset();
+  return true;
+}
+
+/*************************************************
+   Dropping recipe state, target is left as is
+ **************************************************/
+void recipe_abort() {
+  recipe_active = false;
+  recipe_next_ready = false;
+  settings.recipe_running = 0;
+}
+
+/*************************************************
+   Ending or aborting recipe, restoring the target
+   it replaced
+ **************************************************/
+void recipe_stop() {
+  if (recipe_active) {
+    recipe_abort();
+    app_target_liters = recipe_saved_target;
+    flowmeter_save();
+  }
+}
+
+/*************************************************
+   Restoring the recipe of a run interrupted by a
+   power loss, at the step its pulses were in.
+   Returns false, target restored, if the recipe
+   was over.
+ **************************************************/
+boolean recipe_resume() {
+  recipe_index = settings.recipe_running - 1;
+  recipe_nb_steps = recipe_count_steps(recipe_index);
+  recipe_base_pulses = settings.recipe_base_pulses;
+  recipe_base_liters = calculateLiters(recipe_base_pulses);
+  recipe_saved_target = settings.recipe_saved_target;
+  recipe_active = true;
+  uint16_t done = flw_pulses - recipe_base_pulses;
+  for (uint8_t i = 0; i < recipe_nb_steps; i++) {
+    recipe_prepare(i);
+    if (recipe_next_end_pulses > done) {
+      recipe_advance();
+      flowstats_reset();
+      return true;
+    }
+  }
+  recipe_stop();
+  return false;
+}
+
+/*************************************************
+   True once the current step volume is delivered
+ **************************************************/
+boolean recipe_step_done() {
+  noInterrupts();
+  uint16_t pulses = flw_pulses;
+  interrupts();
+  return (uint16_t)(pulses - recipe_base_pulses) >= recipe_end_pulses;
+}
+
+/*************************************************
+   True if current step is the last one
+ **************************************************/
+boolean recipe_last_step() {
+  return recipe_step + 1 >= recipe_nb_steps;
+}
+
+/*************************************************
+   True while a timed pause is not over
+ **************************************************/
+boolean recipe_pausing() {
+  return recipe_pause_s == RECIPE_PAUSE_WAIT ||
+         millis() - recipe_pause_start < (uint32_t)recipe_pause_s * 1000;
+}
@@ -14,18 +14,27 @@ const String menus2_reset[] = {
   "   [No]  Yes    ",
   "    No   [Yes]  "
 };
+// Recipe pause menu, after the countdown
+const String menus2_pause[] = {
+  " [Go]Stop ",
+  "  Go[Stop]"
+};
 // Options Menu
 const String menus1_opt[] = {
-  "[cancel]   run  ",
-  " cancel   [run] ",
-  " cancel    run  ",
-  " cancel    run  "
+  "[cancel]run rcp ",
+  " cancel[run]rcp ",
+  " cancel run rcp ",
+  " cancel run rcp ",
+  " cancel run rcp ",
+  " cancel run[rcp]"
 };
 const String menus2_opt[] = {
-  " set     reset  ",
-  " set     reset  ",
-  "[set]    reset  ",
-  " set    [reset] "
+  " set  reset cfg ",
+  " set  reset cfg ",
+  "[set] reset cfg ",
+  " set [reset] cfg",
+  " set  reset[cfg]",
+  " set  reset cfg "
 };
 
 int screen_choice = 0;
@@ -98,6 +107,20 @@ void lcd_reset_mode() {
   screen_line2 = menus2_reset[screen_choice];
 }
 
+/**************************************************
+   Displaying data on lcd
+   Step : APP_RESUME
+   displaying :
+    Resume 3.20 L ?
+    [No] [Yes]
+ **************************************************/
+void lcd_resume_mode(float remaining_liters) {
+  // background color Orange
+  lcd_setbacklight(255, 50, 0);
+  screen_line1 = "Resume " + String(remaining_liters) + " L ?  ";
+  screen_line2 = menus2_reset[screen_choice];
+}
+
 /*************************************************
   Displaying data on lcd
   Step : APP_OPTIONS
@@ -128,6 +151,22 @@ void lcd_setting_mode(String nb_liters) {
   screen_line2 = nb_liters + " L ";
 }
 
+/*************************************************
+   Displaying data on lcd
+   Step : APP_CONFIG
+   Turning the rotary enc changes value by the
+   setting step
+   displaying :
+     K factor Hz/Lpm
+     8.10
+ **************************************************/
+void lcd_config_mode(const char *label, float value) {
+  // background color Orange
+  lcd_setbacklight(255, 165, 0);
+  screen_line1 = label;
+  screen_line2 = String(value) + "          ";
+}
+
 /*************************************************
   Displaying data on lcd
   Step : APP_WAITING
@@ -152,6 +191,79 @@ void lcd_waiting_mode(float flow_rate, float total_liters, float pct, float flow
  **************************************************/
 void lcd_running_mode(float flow_rate, float total_liters, float pct, float flow_liters) {
   lcd_waiting_mode(flow_rate, total_liters, pct, flow_liters);
+  // Recipe step replaces total volume
+  if (recipe_active) {
+    screen_line1 = recipe_line;
+  }
+}
+
+/*************************************************
+   Displaying data on lcd
+   Step : APP_RECIPE
+   Turning the rotary enc selects a recipe
+   displaying :
+    Recipe 1 4 steps
+    25.50 L
+ **************************************************/
+void lcd_recipe_mode() {
+  // background color Orange
+  lcd_setbacklight(255, 165, 0);
+  if (screen_choice >= RECIPE_NB) {
+    screen_line1 = "Recipe ?        ";
+    screen_line2 = "[cancel]        ";
+    return;
+  }
+  screen_line1 = "Recipe " + String(screen_choice + 1) + " " + String(recipe_count_steps(screen_choice)) + " steps ";
+  screen_line2 = String(recipe_total_liters(screen_choice)) + " L         ";
+}
+
+/*************************************************
+   Displaying data on lcd
+   Step : APP_PAUSE
+   displaying :
+    Step 2/4 3.00 L
+    120s [Go]Stop    or    Push [Go]Stop
+   turning the encoder selects go or stop
+ **************************************************/
+void lcd_pause_mode() {
+  lcd_setbacklight(255, 165, 0);
+  screen_line1 = recipe_line;
+  if (recipe_pause_s == RECIPE_PAUSE_WAIT) {
+    screen_line2 = "Push";
+  } else {
+    uint32_t elapsed = (millis() - recipe_pause_start) / 1000;
+    screen_line2 = String(elapsed < recipe_pause_s ? recipe_pause_s - elapsed : 0) + "s";
+  }
+  screen_line2 += menus2_pause[screen_choice];
+  // Countdown shrinks, erasing previous characters
+  while (screen_line2.length() < 16) {
+    screen_line2 += ' ';
+  }
+}
+
+/*************************************************
+   Displaying data on lcd
+   Step : APP_SUMMARY
+   Flow rates in L/min, one page per screen_choice
+   (SUMMARY_NB_PAGES), one value per line :
+    Avg 5.2 L/min    Min 3.1 L/min    P90 6.0 L/min    Total 12.45 L
+    Med 5.3 L/min    Max 6.2 L/min    Sd 0.4 n 123     Low 12 s
+ **************************************************/
+#define SUMMARY_NB_PAGES 4
+void lcd_summary_mode() {
+  if (screen_choice == 0) {
+    screen_line1 = "Avg " + String(flst_mean, 1) + " L/min";
+    screen_line2 = "Med " + String(p2_value(&flst_median), 1) + " L/min";
+  } else if (screen_choice == 1) {
+    screen_line1 = "Min " + String(flst_min, 1) + " L/min";
+    screen_line2 = "Max " + String(flst_max, 1) + " L/min";
+  } else if (screen_choice == 2) {
+    screen_line1 = "P90 " + String(p2_value(&flst_p90), 1) + " L/min";
+    screen_line2 = "Sd " + String(flowstats_stddev(), 1) + " n " + String(flst_count);
+  } else {
+    screen_line1 = "Total " + String(flowmeter_liters) + " L";
+    screen_line2 = "Low " + String(flst_below_nominal_ms / 1000) + " s";
+  }
 }
 
 /*************************************************
@@ -175,7 +287,7 @@ void lcd_test_screens() {
   // Testing LCD (All screens)
   // Options Screen
   lcd.clear();
-  for (int x = 0; x <= 3; x++) {
+  for (int x = 0; x <= 5; x++) {
     screen_choice = x;
     lcd_options_mode();
     lcd_print();
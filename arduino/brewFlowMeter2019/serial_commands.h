@@ -0,0 +1,373 @@
+// Serial command interface
+// Lets a brewery controller drive the meter with one command per line
+// (terminated by '\n', '\r' is ignored, case insensitive) :
+//   TARGET <liters>  set app_target_liters (not while running or in a recipe)
+//   START            open valve and run toward target
+//   STOP             close valve (ending any recipe), showing the run summary if running
+//   STATUS           report state, target, volumes, pct and flow rate
+//   DIAG             report flowsensor glitch filter counters
+//   RECIPE <n>       report steps of recipe n (1..RECIPE_NB)
+//   RECIPE <n> <steps> replace recipe n, steps are <liters>, <liters>P<seconds>
+//                    (pause before step) or <liters>P (pause until push or START)
+//   RUN <n>          run recipe n
+//   CONFIG           report runtime settings
+//   CONFIG <key> <v> change and save a runtime setting (not while running)
+//   RESET            erase all stored values and restart
+// Every command gets exactly one answer line starting with "OK" or "ERR".
+// START, STOP and RUN answers end with the latency in microseconds from
+// the previous poll of the serial port (the terminator arrived after it)
+// to the valve action. The main loop polls between its screen updates :
+// about 20 ms at most, plus 3.3 ms per changed eeprom byte when the run
+// starts or ends in that pass. Above SERIAL_MAX_LATENCY_US, the worst
+// case, a command is logged.
+
+// Line buffer : no dynamic allocation, overflowing lines are dropped.
+char serial_cmd_buf[SERIAL_CMD_MAX_LEN + 1];
+uint8_t serial_cmd_len = 0;
+boolean serial_cmd_overflow = false;
+unsigned long serial_last_poll_us = 0;  // micros() of the previous poll
+
+/*************************************************
+   Answering the status of the application
+ **************************************************/
+void serial_send_status() {
+  Serial.print(F("OK STATUS "));
+  Serial.print(app_status);
+  Serial.print(' ');
+  Serial.print(app_target_liters);
+  Serial.print(' ');
+  Serial.print(flowmeter_liters);
+  Serial.print(' ');
+  Serial.print(flowmeter_total_liters);
+  Serial.print(' ');
+  Serial.print((int)app_pct_target_liters);
+  Serial.print(' ');
+  Serial.println(flowmeter_rate_lpm());
+}
+
+/*************************************************
+   Answering flowsensor glitch filter counters :
+   rejected short levels, rejected too fast pulses,
+   interrupt maskings and current masking state
+ **************************************************/
+void serial_send_diagnostics() {
+  noInterrupts();
+  uint16_t width = flw_rejected_width;
+  uint16_t rate = flw_rejected_rate;
+  uint16_t masks = flw_mask_count;
+  boolean masked = flw_masked;
+  interrupts();
+  Serial.print(F("OK DIAG "));
+  Serial.print(width);
+  Serial.print(' ');
+  Serial.print(rate);
+  Serial.print(' ');
+  Serial.print(masks);
+  Serial.print(' ');
+  Serial.println(masked);
+}
+
+/*************************************************
+   Injecting a state into the state machine and
+   handling it right away, so the valve acts
+   before we answer.
+ **************************************************/
+void serial_apply_state(int state, unsigned long received_at, const __FlashStringHelper *name) {
+  application_goto_state(state);
+  handle_application_screens();
+  unsigned long latency = app_valve_action_us - received_at;
+  if (latency > SERIAL_MAX_LATENCY_US) {
+    LOG_ERROR(LOG_SERIAL_LATE, latency / 1000);
+  }
+  Serial.print(F("OK "));
+  Serial.print(name);
+  Serial.print(' ');
+  Serial.println(latency);
+}
+
+/*************************************************
+   Ending the word at the start of line, returns
+   the rest of the line without leading spaces
+ **************************************************/
+char *serial_split_word(char *line) {
+  char *rest = line;
+  while (*rest != '\0' && *rest != ' ') {
+    rest++;
+  }
+  if (*rest == ' ') {
+    *rest++ = '\0';
+    while (*rest == ' ') {
+      rest++;
+    }
+  }
+  return rest;
+}
+
+/*************************************************
+   Recipe index from its number (1..RECIPE_NB),
+   -1 if arg is anything else
+ **************************************************/
+int serial_recipe_number(const char *arg) {
+  char *end;
+  long n = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || n < 1 || n > RECIPE_NB) {
+    return -1;
+  }
+  return n - 1;
+}
+
+/*************************************************
+   Answering runtime settings, or changing one :
+   arg is "" or "<key> <value>"
+ **************************************************/
+void serial_config(char *arg) {
+  if (*arg == '\0') {
+    Serial.print(F("OK CONFIG"));
+    for (uint8_t i = 0; i < SETTINGS_NB_ENTRIES; i++) {
+      Serial.print(' ');
+      Serial.print(settings_entries[i].key);
+      Serial.print('=');
+      Serial.print(*settings_entries[i].value);
+    }
+    Serial.println();
+    return;
+  }
+
+  char *value = serial_split_word(arg);
+  int i = settings_find_entry(arg);
+  if (i < 0) {
+    Serial.println(F("ERR CONFIG unknown key"));
+    return;
+  }
+  char *end;
+  float v = strtod(value, &end);
+  if (end == value || *end != '\0' || !isfinite(v)) {
+    Serial.println(F("ERR CONFIG bad value"));
+    return;
+  }
+  if (app_status == APP_RUNNING) {
+    Serial.println(F("ERR CONFIG busy"));
+    return;
+  }
+  settings_set_entry(i, v);
+  settings_save();
+  Serial.print(F("OK CONFIG "));
+  Serial.print(settings_entries[i].key);
+  Serial.print(' ');
+  Serial.println(*settings_entries[i].value);
+}
+
+/*************************************************
+   Answering steps of recipe n
+ **************************************************/
+void serial_send_recipe(uint8_t n) {
+  Serial.print(F("OK RECIPE "));
+  Serial.print(n + 1);
+  for (uint8_t i = 0; i < recipe_count_steps(n); i++) {
+    const recipe_step_t *step = &settings.recipes[n][i];
+    Serial.print(' ');
+    Serial.print(step->liters);
+    if (step->pause_s == RECIPE_PAUSE_WAIT) {
+      Serial.print('P');
+    } else if (step->pause_s > 0) {
+      Serial.print('P');
+      Serial.print(step->pause_s);
+    }
+  }
+  Serial.println();
+}
+
+/*************************************************
+   Answering a recipe, or replacing it :
+   arg is "<n>" or "<n> <step> <step>..."
+ **************************************************/
+void serial_recipe(char *arg) {
+  char *steps = serial_split_word(arg);
+  int n = serial_recipe_number(arg);
+  if (n < 0) {
+    Serial.println(F("ERR RECIPE bad number"));
+    return;
+  }
+  if (*steps == '\0') {
+    serial_send_recipe(n);
+    return;
+  }
+  if (recipe_active || app_status == APP_RUNNING) {
+    Serial.println(F("ERR RECIPE busy"));
+    return;
+  }
+
+  // Parsing in a copy, recipe is unchanged on error
+  recipe_step_t parsed[RECIPE_MAX_STEPS];
+  memset(parsed, 0, sizeof(parsed));
+  uint8_t i = 0;
+  float total = 0;
+  while (*steps != '\0') {
+    char *next = serial_split_word(steps);
+    char *end;
+    float liters = strtod(steps, &end);
+    // Comparison is false on NaN
+    if (i >= RECIPE_MAX_STEPS || end == steps || !(liters > 0) || isinf(liters)) {
+      Serial.println(F("ERR RECIPE bad step"));
+      return;
+    }
+    parsed[i].liters = liters;
+    if (*end == 'P') {
+      end++;
+      if (*end == '\0') {
+        parsed[i].pause_s = RECIPE_PAUSE_WAIT;
+      } else {
+        char *digits = end;
+        long pause_s = strtol(digits, &end, 10);
+        if (end == digits || pause_s < 0 || pause_s >= RECIPE_PAUSE_WAIT) {
+          Serial.println(F("ERR RECIPE bad pause"));
+          return;
+        }
+        parsed[i].pause_s = pause_s;
+      }
+    }
+    if (*end != '\0') {
+      Serial.println(F("ERR RECIPE bad step"));
+      return;
+    }
+    total += liters;
+    i++;
+    steps = next;
+  }
+  if (!recipe_fits(total)) {
+    Serial.println(F("ERR RECIPE too large"));
+    return;
+  }
+  memcpy(settings.recipes[n], parsed, sizeof(parsed));
+  settings_save();
+  serial_send_recipe(n);
+}
+
+/*************************************************
+   Parsing and executing a complete command line
+ **************************************************/
+void serial_execute_command(char *cmd, unsigned long received_at) {
+  // Upper case the line, split the command word from its argument
+  for (char *c = cmd; *c != '\0'; c++) {
+    *c = toupper(*c);
+  }
+  char *arg = serial_split_word(cmd);
+
+  if (strcmp(cmd, "TARGET") == 0) {
+    char *end;
+    float liters = strtod(arg, &end);
+    if (end == arg || *end != '\0' || !isfinite(liters) || liters < 0) {
+      Serial.println(F("ERR TARGET bad value"));
+      return;
+    }
+    // A recipe sets the target of each step
+    if (app_status == APP_RUNNING || recipe_active) {
+      Serial.println(F("ERR TARGET busy"));
+      return;
+    }
+    app_target_liters = liters;
+    flowmeter_save();
+    // Refresh the waiting screen with the new target
+    if (app_status == APP_WAITING) {
+      application_goto_state(APP_WAITING);
+    }
+    Serial.print(F("OK TARGET "));
+    Serial.println(app_target_liters);
+    return;
+  }
+
+  if (strcmp(cmd, "START") == 0) {
+    if (app_target_liters <= 0) {
+      Serial.println(F("ERR START no target"));
+      return;
+    }
+    if (app_status == APP_RUNNING) {
+      Serial.println(F("ERR START already running"));
+      return;
+    }
+    serial_apply_state(APP_RUNNING, received_at, F("START"));
+    return;
+  }
+
+  if (strcmp(cmd, "STOP") == 0) {
+    // A closing run shows its statistics, like a push would
+    serial_apply_state(app_status == APP_RUNNING ? APP_SUMMARY : APP_WAITING, received_at, F("STOP"));
+    return;
+  }
+
+  if (strcmp(cmd, "STATUS") == 0) {
+    serial_send_status();
+    return;
+  }
+
+  if (strcmp(cmd, "DIAG") == 0) {
+    serial_send_diagnostics();
+    return;
+  }
+
+  if (strcmp(cmd, "RECIPE") == 0) {
+    serial_recipe(arg);
+    return;
+  }
+
+  if (strcmp(cmd, "RUN") == 0) {
+    if (recipe_active || app_status == APP_RUNNING) {
+      Serial.println(F("ERR RUN busy"));
+      return;
+    }
+    int n = serial_recipe_number(arg);
+    if (n < 0 || !recipe_start(n)) {
+      Serial.println(F("ERR RUN bad recipe"));
+      return;
+    }
+    serial_apply_state(recipe_pause_s ? APP_PAUSE : APP_RUNNING, received_at, F("RUN"));
+    return;
+  }
+
+  if (strcmp(cmd, "CONFIG") == 0) {
+    serial_config(arg);
+    return;
+  }
+
+  if (strcmp(cmd, "RESET") == 0) {
+    application_reset();
+    Serial.println(F("OK RESET"));
+    return;
+  }
+
+  Serial.println(F("ERR unknown command"));
+}
+
+/*************************************************
+   Serial commands controller
+   Never blocks : only consumes the bytes already
+   received, a command runs as soon as its line
+   is complete. Bytes waiting now arrived after
+   the previous poll, it dates them.
+ **************************************************/
+void handle_serial_commands() {
+  unsigned long received_at = serial_last_poll_us;
+  serial_last_poll_us = micros();
+  while (Serial.available() > 0) {
+    char c = Serial.read();
+    if (c == '\r') {
+      continue;
+    }
+    if (c == '\n') {
+      if (serial_cmd_overflow) {
+        Serial.println(F("ERR line too long"));
+      } else if (serial_cmd_len > 0) {
+        serial_cmd_buf[serial_cmd_len] = '\0';
+        serial_execute_command(serial_cmd_buf, received_at);
+      }
+      serial_cmd_len = 0;
+      serial_cmd_overflow = false;
+      continue;
+    }
+    if (serial_cmd_len < SERIAL_CMD_MAX_LEN) {
+      serial_cmd_buf[serial_cmd_len++] = c;
+    } else {
+      serial_cmd_overflow = true;
+    }
+  }
+}
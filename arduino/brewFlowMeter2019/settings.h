@@ -0,0 +1,206 @@
+#include <EEPROM.h>
+
+// Runtime settings stored in EEPROM
+// One versioned block, checked by a CRC, read in one pass at boot.
+// Defaults come from config.h and are applied when the block is missing
+// or corrupted. Schema changes : only append fields at the end of
+// settings_t and bump SETTINGS_VERSION, an older block then keeps its
+// stored values and new fields keep their defaults. Fields are never
+// moved, resized or reused : older blocks are only read that way.
+
+#define SETTINGS_ADDR    0
+#define POWERFAIL_ADDR   256   // After settings block, see powerfail.h
+#define SETTINGS_MAGIC   0xBF
+// Version 1 : three raw floats, no header (BrewFlowMeter v2.0)
+// Version 2 : header, configuration, target liters and counters
+// Version 3 : dispensing flag appended
+// Version 4 : recipes appended
+// Version 5 : recipe of the dispensing run appended
+#define SETTINGS_VERSION 5
+
+// Version 1 eeprom addresses
+#define SETTINGS_V1_TOTAL_PULSES_ADDR 0
+#define SETTINGS_V1_CURRENT_PULSES_ADDR 8
+#define SETTINGS_V1_TARGET_LITERS_ADDR 16
+
+// Recipe step : volume to deliver, after an optional pause
+#define RECIPE_PAUSE_WAIT 0xFFFF  // Pause until button push or START command
+struct recipe_step_t {
+  float liters;          // 0 ends the recipe
+  uint16_t pause_s;      // Pause before the step, seconds
+};
+
+struct settings_t {
+  // Header, not covered by CRC
+  uint8_t magic;
+  uint8_t version;
+  uint8_t size;          // sizeof(settings_t) of the firmware that wrote it (255 max)
+  uint16_t crc;          // CRC-16 of bytes after header, up to size
+  // Runtime configuration
+  float k_factor;        // Sensor frequency (Hz) per L/min
+  float enc_step;        // Liters per encoder step
+  float nominal_rate;    // L/min, flow below is timed in dispense statistics
+  // Stored values
+  float target_liters;
+  uint16_t pulses;
+  uint16_t total_pulses;
+  // Version 3
+  uint8_t dispensing;    // A run was in progress, counters are the ones at its start
+  // Version 4
+  recipe_step_t recipes[RECIPE_NB][RECIPE_MAX_STEPS];
+  // Version 5, saved with dispensing flag
+  uint8_t recipe_running;       // Recipe being run + 1, 0 if none
+  uint16_t recipe_base_pulses;  // pulses when it started
+  float recipe_saved_target;    // target_liters it replaced
+};
+
+#define SETTINGS_HEADER_SIZE offsetof(settings_t, k_factor)
+
+static_assert(sizeof(settings_t) <= 255 && SETTINGS_ADDR + sizeof(settings_t) <= POWERFAIL_ADDR,
+              "settings block must fit its size byte and end before the power fail record");
+
+settings_t settings;
+
+// Editable entries, on options screen and serial port
+struct settings_entry_t {
+  const char *key;       // Serial command key
+  const char *label;     // LCD label (16 chars max)
+  float *value;
+  float step;            // Change per encoder step
+  float min;
+  float max;
+};
+
+const settings_entry_t settings_entries[] = {
+  { "KFACTOR", "K factor Hz/Lpm ", &settings.k_factor,     0.1,  1.0,  100.0 },
+  { "ENCSTEP", "Encoder step L  ", &settings.enc_step,     0.01, 0.01, 10.0 },
+  { "NOMINAL", "Nominal L/min   ", &settings.nominal_rate, 0.5,  0.0,  100.0 }
+};
+#define SETTINGS_NB_ENTRIES (sizeof(settings_entries) / sizeof(settings_entry_t))
+
+/*************************************************
+   CRC-16 CCITT of the block after its header
+ **************************************************/
+uint16_t settings_crc(const settings_t *s, uint8_t size) {
+  const uint8_t *buf = (const uint8_t *)s;
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = SETTINGS_HEADER_SIZE; i < size; i++) {
+    crc ^= (uint16_t)buf[i] << 8;
+    for (uint8_t b = 0; b < 8; b++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+/*************************************************
+   Default settings from config.h
+ **************************************************/
+void settings_defaults() {
+  settings.magic = SETTINGS_MAGIC;
+  settings.version = SETTINGS_VERSION;
+  settings.size = sizeof(settings_t);
+  settings.k_factor = FLW_K_FACTOR;
+  settings.enc_step = ENC_STEP;
+  settings.nominal_rate = FLW_NOMINAL_RATE;
+  settings.target_liters = 0;
+  settings.pulses = 0;
+  settings.total_pulses = 0;
+  settings.dispensing = 0;
+  memset(settings.recipes, 0, sizeof(settings.recipes));
+  settings.recipe_running = 0;
+  settings.recipe_base_pulses = 0;
+  settings.recipe_saved_target = 0;
+}
+
+/*************************************************
+   Saving settings, only changed bytes are written
+ **************************************************/
+void settings_save() {
+  settings.magic = SETTINGS_MAGIC;
+  settings.version = SETTINGS_VERSION;
+  settings.size = sizeof(settings_t);
+  settings.crc = settings_crc(&settings, sizeof(settings_t));
+  EEPROM.put(SETTINGS_ADDR, settings);
+}
+
+/*************************************************
+   Reading a float from EEPROM
+ **************************************************/
+float eeprom_read(int addr) {
+  float f;
+  EEPROM.get(addr, f);
+  return f;
+}
+
+/*************************************************
+   Importing version 1 raw floats, if they look
+   like values BrewFlowMeter v2.0 wrote
+ **************************************************/
+boolean settings_load_v1() {
+  float pulses = eeprom_read(SETTINGS_V1_CURRENT_PULSES_ADDR);
+  float total_pulses = eeprom_read(SETTINGS_V1_TOTAL_PULSES_ADDR);
+  float target_liters = eeprom_read(SETTINGS_V1_TARGET_LITERS_ADDR);
+  // Comparisons are false on NaN, i.e. an erased eeprom
+  if (!(pulses >= 0 && pulses <= 65535) ||
+      !(total_pulses >= 0 && total_pulses <= 65535) ||
+      !(target_liters >= 0 && target_liters <= 1000)) {
+    return false;
+  }
+  settings.pulses = pulses;
+  settings.total_pulses = total_pulses;
+  settings.target_liters = target_liters;
+  return true;
+}
+
+/*************************************************
+   Loading settings at boot (to be included in
+   general setup, before flowmeter setup)
+ **************************************************/
+void settings_load() {
+  settings_t stored;
+  EEPROM.get(SETTINGS_ADDR, stored);
+  settings_defaults();
+
+  if (stored.magic == SETTINGS_MAGIC && stored.version >= 2 && stored.version <= SETTINGS_VERSION &&
+      stored.size > SETTINGS_HEADER_SIZE && stored.size <= sizeof(settings_t) &&
+      stored.crc == settings_crc(&stored, stored.size)) {
+    // Same or older block : stored values over defaults, appended fields keep them
+    memcpy((uint8_t *)&settings + SETTINGS_HEADER_SIZE, (uint8_t *)&stored + SETTINGS_HEADER_SIZE,
+           stored.size - SETTINGS_HEADER_SIZE);
+    if (stored.version == SETTINGS_VERSION && stored.size == sizeof(settings_t)) {
+      return;
+    }
+    LOG_INFO(LOG_SETTINGS_MIGRATED, stored.version);
+  } else if (stored.magic != SETTINGS_MAGIC && settings_load_v1()) {
+    LOG_INFO(LOG_SETTINGS_MIGRATED, 1);
+  } else {
+    LOG_ERROR(LOG_SETTINGS_DEFAULTS);
+  }
+  settings_save();
+}
+
+/*************************************************
+   Changing an entry, value is clamped to its range.
+   Returns false, entry unchanged, on NaN or INF
+ **************************************************/
+boolean settings_set_entry(uint8_t i, float value) {
+  if (!isfinite(value)) {
+    return false;
+  }
+  const settings_entry_t *e = &settings_entries[i];
+  *e->value = constrain(value, e->min, e->max);
+  return true;
+}
+
+/*************************************************
+   Finding an entry by its serial key, -1 if none
+ **************************************************/
+int settings_find_entry(const char *key) {
+  for (uint8_t i = 0; i < SETTINGS_NB_ENTRIES; i++) {
+    if (strcmp(key, settings_entries[i].key) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}